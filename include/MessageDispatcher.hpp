@@ -0,0 +1,280 @@
+/**
+  * Copyright (C) 2020 Salvo Limited Hong Kong
+  *
+  *  Licensed under the Apache License, Version 2.0 (the "License");
+  *  you may not use this file except in compliance with the License.
+  *  You may obtain a copy of the License at
+  *
+  *      http://www.apache.org/licenses/LICENSE-2.0
+  *
+  *  Unless required by applicable law or agreed to in writing, software
+  *  distributed under the License is distributed on an "AS IS" BASIS,
+  *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  *  See the License for the specific language governing permissions and
+  *  limitations under the License.
+  *
+***/
+#ifndef __MessageDispatcher__
+#define __MessageDispatcher__
+#include "MessageQueue.hpp"
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <memory>
+#include <sched.h>
+#include <pthread.h>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Runs reader loops for any number of MessageQueues on a small set of poller threads.
+// Handlers are registered with add() before start(); each handler is owned by exactly
+// one poller thread, so callbacks for a given queue are never run concurrently and see
+// messages in order. Each pass, a poller drains up to "budget" messages from each of its
+// handlers in turn so that one busy queue can't starve the others.
+namespace Salvo {
+
+  // what a poller does when a full pass over its handlers found nothing to read
+  enum class IdleStrategy {
+    Spin,   // busy-loop; lowest latency, burns the core
+    Yield,  // sched_yield() between passes
+    Park    // usleep() with backoff up to DispatcherConfig::maxParkMicros
+  };
+
+  struct DispatcherConfig
+  {
+    size_t threads = 1;
+    std::vector<int> cpus;          // cpus[i] pins poller i (modulo size); empty => no pinning
+    IdleStrategy idle = IdleStrategy::Spin;
+    size_t spinsBeforeIdle = 1000;  // empty passes before the idle strategy kicks in; also how often
+                                    // (in empty passes per handler) a handler checks whether it was lapped
+    useconds_t maxParkMicros = 1000;
+  };
+
+  // Per-handler counters. Only the owning poller thread writes these, so relaxed atomics suffice;
+  // readers on other threads get a consistent-enough snapshot for monitoring.
+  struct DispatchStats
+  {
+    std::atomic<int64_t> messages;
+    std::atomic<int64_t> batches;   // passes that delivered at least one message
+    std::atomic<int64_t> totalNanos;
+    std::atomic<int64_t> maxBatchNanos;
+    std::atomic<int64_t> maxBatchMessages; // never more than the handler's budget
+    std::atomic<int64_t> dropped;   // messages skipped because the reader was lapped by the writer
+    std::atomic<int64_t> exceptions; // callbacks that threw; the message counts as consumed
+    DispatchStats(): messages(0), batches(0), totalNanos(0), maxBatchNanos(0), maxBatchMessages(0),
+      dropped(0), exceptions(0) { }
+  };
+
+  class MessageDispatcher {
+    public:
+      typedef size_t HandlerId;
+
+      explicit MessageDispatcher(const DispatcherConfig& config = DispatcherConfig()): _config(config), _running(false) {
+        if (_config.threads == 0) throw std::invalid_argument("MessageDispatcher needs at least one thread");
+        for (size_t i = 0; i < _config.cpus.size(); ++i) {
+          if (_config.cpus[i] < 0 || _config.cpus[i] >= CPU_SETSIZE) {
+            throw std::invalid_argument("MessageDispatcher cpu " + std::to_string(_config.cpus[i]) + " out of range");
+          }
+        }
+      }
+      ~MessageDispatcher() {
+        if (pollingFor() == this) {
+          fprintf(stderr, "MessageDispatcher destroyed from one of its own callbacks, aborting\n");
+          std::terminate();
+        }
+        stop();
+      }
+
+      // Registers callback(const PAYLOAD&) on queue. Reading starts at the queue's current writeCount()
+      // unless startReadCount is given. Handlers are spread round-robin over the pollers unless thread is given.
+      // The queue must outlive the dispatcher (or at least stop()).
+      // Exceptions thrown by the callback are caught, logged and counted in DispatchStats::exceptions.
+      // A callback may call stop(): the pollers finish their pass and exit, but are only joined by the
+      // next stop() (or the destructor) called from outside the pollers. A callback must not destroy
+      // its own dispatcher (that std::terminate()s, as its poller threads can't be joined).
+      template <class QUEUE, class CALLBACK>
+        HandlerId add(const QUEUE* queue, CALLBACK callback, size_t budget = 64,
+            int64_t startReadCount = -1, int thread = -1) {
+          if (_running || !_pollers.empty()) throw std::logic_error("MessageDispatcher::add called after start()");
+          if (budget == 0) throw std::invalid_argument("MessageDispatcher handler budget must be positive");
+          if (thread >= int(_config.threads)) throw std::out_of_range("MessageDispatcher thread index out of range");
+          HandlerId id = _handlers.size();
+          _handlers.push_back(std::unique_ptr<HandlerBase>(new QueueHandler<QUEUE, CALLBACK>(
+                  queue, callback, budget, startReadCount < 0 ? queue->writeCount() : startReadCount,
+                  thread < 0 ? id % _config.threads : size_t(thread),
+                  std::max<size_t>(_config.spinsBeforeIdle, 1))));
+          return id;
+        }
+
+      // pollers that own no handlers aren't started, so they don't sit spinning on a core
+      void start() {
+        if (_running) return;
+        stop(); // joins pollers left over from a stop() made inside a callback
+        _running = true;
+        for (size_t i = 0; i < _config.threads; ++i) {
+          std::vector<HandlerBase*> mine;
+          for (size_t j = 0; j < _handlers.size(); ++j) {
+            if (_handlers[j]->_thread == i) mine.push_back(_handlers[j].get());
+          }
+          if (mine.empty()) continue;
+          _pollers.push_back(std::thread([this, i, mine]() { poll(i, mine); }));
+        }
+      }
+      // returns once every poller has finished its current pass (unless called from a callback, see add())
+      void stop() {
+        _running = false;
+        if (pollingFor() == this) return;
+        std::for_each(_pollers.begin(), _pollers.end(), [](std::thread &t) { t.join(); });
+        _pollers.clear();
+      }
+      bool running() const { return _running; }
+      size_t pollerCount() const { return _pollers.size(); }
+
+      size_t handlerCount() const { return _handlers.size(); }
+      const DispatchStats& stats(HandlerId id) const { return _handlers.at(id)->_stats; }
+      // next message this handler will read; stable once stop() has returned
+      int64_t readCount(HandlerId id) const { return _handlers.at(id)->_readcount; }
+
+    private:
+      struct HandlerBase {
+        HandlerBase(size_t budget, int64_t readcount, size_t thread, size_t lapCheckEvery):
+          _budget(budget), _readcount(readcount), _thread(thread), _lapCheckEvery(lapCheckEvery), _emptyDrains(0) { }
+        virtual ~HandlerBase() { }
+        // delivers up to _budget messages, returns how many were delivered
+        virtual size_t drain() = 0;
+        // skips ahead if the writer has lapped this reader
+        virtual void catchUp() = 0;
+        void record(size_t n, int64_t elapsed) {
+          _stats.messages.store(_stats.messages.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+          _stats.batches.store(_stats.batches.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+          _stats.totalNanos.store(_stats.totalNanos.load(std::memory_order_relaxed) + elapsed, std::memory_order_relaxed);
+          if (elapsed > _stats.maxBatchNanos.load(std::memory_order_relaxed)) {
+            _stats.maxBatchNanos.store(elapsed, std::memory_order_relaxed);
+          }
+          if (int64_t(n) > _stats.maxBatchMessages.load(std::memory_order_relaxed)) {
+            _stats.maxBatchMessages.store(n, std::memory_order_relaxed);
+          }
+        }
+        void failed() {
+          _stats.exceptions.store(_stats.exceptions.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        }
+        size_t _budget;
+        volatile int64_t _readcount;
+        size_t _thread;
+        size_t _lapCheckEvery;
+        size_t _emptyDrains;
+        DispatchStats _stats;
+      };
+
+      template <class QUEUE, class CALLBACK>
+        struct QueueHandler : HandlerBase {
+          QueueHandler(const QUEUE* queue, CALLBACK callback, size_t budget, int64_t readcount, size_t thread,
+              size_t lapCheckEvery):
+            HandlerBase(budget, readcount, thread, lapCheckEvery), _queue(queue), _callback(callback) { }
+          // An empty drain only touches the slot's lapCount, like a hand-written recv() loop: no clock reads,
+          // and the writer's header (writeCount) is only read by catchUp() every _lapCheckEvery empty drains.
+          // A lapped reader never sees data again, so finding it late costs nothing.
+          size_t drain() {
+            size_t n = 0;
+            int64_t t0 = 0;
+            for (; n < _budget; ++n) {
+              auto msg = _queue->recv(_readcount);
+              if (!msg) break;
+              if (n == 0) t0 = monotonicNanos();
+              try {
+                _callback(*msg);
+              } catch (const std::exception& e) {
+                fprintf(stderr, "MessageDispatcher: callback threw at readcount %ld: %s\n", int64_t(_readcount), e.what());
+                failed();
+              } catch (...) {
+                fprintf(stderr, "MessageDispatcher: callback threw at readcount %ld\n", int64_t(_readcount));
+                failed();
+              }
+            }
+            if (n) {
+              record(n, monotonicNanos() - t0);
+              _emptyDrains = 0;
+            } else if (++_emptyDrains % _lapCheckEvery == 0) {
+              catchUp();
+            }
+            return n;
+          }
+          void catchUp() {
+            // a lapped reader would otherwise wait forever on a lapCount that never comes back around,
+            // so skip ahead to half a queue behind the writer (see README)
+            if (_queue->writeCount() - _readcount >= int64_t(QUEUE::capacity())) {
+              int64_t skipTo = _queue->writeCount() - int64_t(QUEUE::capacity() / 2);
+              _stats.dropped.store(_stats.dropped.load(std::memory_order_relaxed) + (skipTo - _readcount), std::memory_order_relaxed);
+              _readcount = skipTo;
+            }
+          }
+          const QUEUE* _queue;
+          CALLBACK _callback;
+        };
+
+      // the dispatcher whose poller is running on this thread, if any
+      static MessageDispatcher*& pollingFor() {
+        static thread_local MessageDispatcher* dispatcher = NULL;
+        return dispatcher;
+      }
+
+      static int64_t monotonicNanos() {
+        timespec tp;
+        clock_gettime(CLOCK_MONOTONIC, &tp);
+        return int64_t(tp.tv_sec)*1000*1000*1000 + int64_t(tp.tv_nsec);
+      }
+
+      void pin(size_t index) {
+        if (_config.cpus.empty()) return;
+        cpu_set_t cpus;
+        CPU_ZERO(&cpus);
+        CPU_SET(_config.cpus[index % _config.cpus.size()], &cpus);
+        int s = pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus);
+        if (s != 0) {
+          fprintf(stderr, "MessageDispatcher: failed to pin poller %zu to cpu %d, error = %d\n",
+              index, _config.cpus[index % _config.cpus.size()], s);
+        }
+      }
+
+      void poll(size_t index, const std::vector<HandlerBase*>& mine) {
+        pin(index);
+        pollingFor() = this;
+        size_t emptyPasses = 0;
+        useconds_t park = 1;
+        while (_running) {
+          size_t delivered = 0;
+          for (size_t i = 0; i < mine.size(); ++i) {
+            delivered += mine[i]->drain();
+          }
+          if (delivered) {
+            emptyPasses = 0;
+            park = 1;
+          } else if (++emptyPasses > _config.spinsBeforeIdle) {
+            switch (_config.idle) {
+              case IdleStrategy::Spin: break;
+              case IdleStrategy::Yield: sched_yield(); break;
+              case IdleStrategy::Park:
+                // about to sleep anyway, so this is a cheap moment to look for lapped readers
+                for (size_t i = 0; i < mine.size(); ++i) mine[i]->catchUp();
+                ::usleep(park);
+                park = std::min<useconds_t>(park * 2, std::max<useconds_t>(_config.maxParkMicros, 1));
+                break;
+            }
+          }
+        }
+      }
+
+      DispatcherConfig _config;
+      std::vector<std::unique_ptr<HandlerBase> > _handlers;
+      std::vector<std::thread> _pollers;
+      std::atomic<bool> _running;
+
+      // noncopyable (w/o boost dependency)
+      MessageDispatcher(const MessageDispatcher&) = delete;
+      MessageDispatcher& operator=(const MessageDispatcher&) = delete;
+  };
+
+} // namespace Salvo
+#endif
@@ -0,0 +1,192 @@
+/**
+  * Copyright (C) 2020 Salvo Limited Hong Kong
+  *
+  *  Licensed under the Apache License, Version 2.0 (the "License");
+  *  you may not use this file except in compliance with the License.
+  *  You may obtain a copy of the License at
+  *
+  *      http://www.apache.org/licenses/LICENSE-2.0
+  *
+  *  Unless required by applicable law or agreed to in writing, software
+  *  distributed under the License is distributed on an "AS IS" BASIS,
+  *  WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+  *  See the License for the specific language governing permissions and
+  *  limitations under the License.
+  *
+***/
+#include "../include/MessageDispatcher.hpp"
+#include <sched.h>
+#define BOOST_TEST_DYN_LINK
+#define BOOST_TEST_MAIN
+#include <boost/test/included/unit_test.hpp>
+
+namespace {
+  template <class QUEUE>
+    void waitFor(const Salvo::MessageDispatcher& d, Salvo::MessageDispatcher::HandlerId id, const QUEUE& q) {
+      int64_t start = time(NULL);
+      while (d.readCount(id) < q.writeCount()) {
+        BOOST_REQUIRE(time(NULL) < start + 10);
+        usleep(100);
+      }
+    }
+
+  // the cpus this process may run on, so pinning works under taskset / cgroup cpusets
+  std::vector<int> allowedCpus() {
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    std::vector<int> cpus;
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) return cpus;
+    for (int i = 0; i < CPU_SETSIZE; ++i) {
+      if (CPU_ISSET(i, &set)) cpus.push_back(i);
+    }
+    return cpus;
+  }
+
+  struct NODE {
+    int queue;
+    int64_t seq;
+  };
+  typedef Salvo::MessageQueue<NODE, 1024> Queue;
+}
+
+BOOST_AUTO_TEST_CASE( MessageDispatcherTest )
+{
+  using namespace Salvo;
+  Queue q1, q2, q3;
+  std::vector<int> cpus = allowedCpus();
+  BOOST_REQUIRE(!cpus.empty());
+  for (IdleStrategy idle: std::vector<IdleStrategy>{IdleStrategy::Spin, IdleStrategy::Yield, IdleStrategy::Park}) {
+    DispatcherConfig config;
+    // one poller per cpu, never two spinning pollers sharing a core
+    config.threads = std::min<size_t>(2, cpus.size());
+    config.cpus = std::vector<int>(cpus.begin(), cpus.begin() + config.threads);
+    config.idle = idle;
+    config.spinsBeforeIdle = 10;
+    MessageDispatcher d(config);
+    // each handler is only ever called from its own poller, so per-handler entries need no locking
+    // (not vector<bool>, whose entries share words)
+    std::vector<int64_t> nextSeq(3), received(3);
+    std::vector<int> inOrder(3, 1), pinned(3, 1);
+    Queue* queues[] = { &q1, &q2, &q3 };
+    std::vector<MessageDispatcher::HandlerId> ids;
+    for (int i = 0; i < 3; ++i) {
+      nextSeq[i] = queues[i]->writeCount();
+      int cpu = config.cpus[i % config.threads]; // handlers are spread round-robin
+      ids.push_back(d.add(queues[i], [i, cpu, &nextSeq, &received, &inOrder, &pinned](const NODE& n) {
+            if (n.queue != i || n.seq != nextSeq[i]) inOrder[i] = 0;
+            if (sched_getcpu() != cpu) pinned[i] = 0;
+            ++nextSeq[i];
+            ++received[i];
+            }, 16));
+    }
+    BOOST_REQUIRE(d.handlerCount() == 3);
+    d.start();
+    BOOST_REQUIRE(d.pollerCount() == config.threads);
+    BOOST_REQUIRE_THROW(d.add(&q1, [](const NODE&) { }), std::logic_error);
+    for (int j = 0; j < 500; ++j) {
+      for (int i = 0; i < 3; ++i) {
+        auto w = queues[i]->nextWriteSlot();
+        w->queue = i;
+        w->seq = queues[i]->writeCount();
+      }
+      if (j % 100 == 0) usleep(1000); // let the pollers go idle now and then
+    }
+    for (int i = 0; i < 3; ++i) waitFor(d, ids[i], *queues[i]);
+    d.stop();
+    for (int i = 0; i < 3; ++i) {
+      BOOST_REQUIRE(inOrder[i]);
+      BOOST_REQUIRE(pinned[i]);
+      BOOST_REQUIRE(received[i] == 500);
+      const DispatchStats& s = d.stats(ids[i]);
+      BOOST_REQUIRE(s.messages == 500);
+      BOOST_REQUIRE(s.maxBatchMessages <= 16);
+      BOOST_REQUIRE(s.totalNanos > 0);
+      BOOST_REQUIRE(s.maxBatchNanos > 0);
+      BOOST_REQUIRE(s.dropped == 0);
+      BOOST_REQUIRE(s.exceptions == 0);
+    }
+  }
+
+  { // cpus must fit in a cpu_set_t
+    DispatcherConfig config;
+    config.cpus = std::vector<int>{-1};
+    BOOST_REQUIRE_THROW(MessageDispatcher d(config), std::invalid_argument);
+    config.cpus = std::vector<int>{CPU_SETSIZE};
+    BOOST_REQUIRE_THROW(MessageDispatcher d(config), std::invalid_argument);
+  }
+
+  { // pollers without handlers aren't started
+    DispatcherConfig config;
+    config.threads = 4;
+    MessageDispatcher d(config);
+    d.add(&q1, [](const NODE&) { });
+    d.add(&q2, [](const NODE&) { }, 64, -1, 0);
+    d.start();
+    BOOST_REQUIRE(d.pollerCount() == 1);
+  }
+
+  { // a backlogged queue sharing a poller only gets its budget per pass
+    Queue busy, quiet;
+    const int64_t budget = 16;
+    for (int64_t j = 0; j < 10 * budget; ++j) busy.push_back(NODE{0, j});
+    for (int64_t j = 0; j < 3; ++j) quiet.push_back(NODE{1, j});
+    MessageDispatcher d;
+    int64_t busySeen = 0, busySeenWhenQuietDone = -1;
+    auto busyId = d.add(&busy, [&busySeen](const NODE&) { ++busySeen; }, budget, 0);
+    auto quietId = d.add(&quiet, [&busySeen, &busySeenWhenQuietDone](const NODE& n) {
+          if (n.seq == 2) busySeenWhenQuietDone = busySeen;
+        }, budget, 0);
+    d.start();
+    waitFor(d, busyId, busy);
+    waitFor(d, quietId, quiet);
+    d.stop();
+    BOOST_REQUIRE(busySeenWhenQuietDone == budget); // quiet was served right after busy's first batch
+    BOOST_REQUIRE(d.stats(busyId).maxBatchMessages == budget);
+    BOOST_REQUIRE(d.stats(busyId).batches == 10);
+    BOOST_REQUIRE(d.stats(quietId).maxBatchMessages == 3);
+  }
+
+  { // throwing callbacks are counted and the poller carries on
+    Queue q;
+    for (int64_t j = 0; j < 10; ++j) q.push_back(NODE{0, j});
+    MessageDispatcher d;
+    int64_t delivered = 0;
+    auto id = d.add(&q, [&delivered](const NODE& n) {
+          ++delivered;
+          if (n.seq % 3 == 0) throw std::runtime_error("bad message");
+        }, 64, 0);
+    d.start();
+    waitFor(d, id, q);
+    d.stop();
+    BOOST_REQUIRE(delivered == 10);
+    BOOST_REQUIRE(d.stats(id).exceptions == 4);
+  }
+
+  { // stop() from inside a callback doesn't join its own thread
+    Queue q;
+    q.push_back(NODE{0, 0});
+    MessageDispatcher d;
+    d.add(&q, [&d](const NODE&) { d.stop(); }, 64, 0);
+    d.start();
+    int64_t start = time(NULL);
+    while (d.running()) {
+      BOOST_REQUIRE(time(NULL) < start + 10);
+      usleep(100);
+    }
+    d.stop();
+    BOOST_REQUIRE(d.pollerCount() == 0);
+  }
+
+  { // a reader that has been lapped skips ahead rather than hanging
+    Queue q;
+    MessageDispatcher d;
+    int64_t received = 0;
+    auto id = d.add(&q, [&received](const NODE&) { ++received; });
+    for (size_t j = 0; j < 3 * Queue::capacity(); ++j) q.push_back(NODE());
+    d.start();
+    waitFor(d, id, q);
+    d.stop();
+    BOOST_REQUIRE(d.stats(id).dropped == int64_t(3 * Queue::capacity() - Queue::capacity() / 2));
+    BOOST_REQUIRE(received == int64_t(Queue::capacity() / 2));
+  }
+}